@@ -0,0 +1,119 @@
+// Referenced resources:
+// - https://man7.org/linux/man-pages/man2/mmap.2.html
+// - https://man7.org/linux/man-pages/man3/posix_madvise.3.html
+// - https://man7.org/linux/man-pages/man7/feature_test_macros.7.html
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "input.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Pipes (and other things that can't be mapped) are read in chunks this big.
+#define INPUT_BUFFER_SIZE (1024 * 1024)
+
+static void warn_trailing_bytes(size_t count)
+{
+    if (count) {
+        printf("[WARNING] ignoring %zu trailing byte(s) of input (not a whole double)\n",
+            count);
+    }
+}
+
+InputFeed *open_input(char const *path)
+{
+    InputFeed *feed = calloc(sizeof(*feed), 1);
+    if (feed == NULL) {
+        printf("[FATAL] failed to malloc input feed\n");
+        return NULL;
+    }
+    feed->fd = (strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY));
+    if (feed->fd == -1) {
+        printf("[FATAL] can't open input: %s\n", path);
+        free(feed);
+        return NULL;
+    }
+
+    // Regular files (even when redirected to stdin) are mapped in one go, that way the
+    // whole input is available upfront and reading never needs a syscall.
+    struct stat st;
+    if (fstat(feed->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size_t size = (size_t)st.st_size;
+        void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, feed->fd, 0);
+        if (map != MAP_FAILED) {
+            posix_madvise(map, size, POSIX_MADV_SEQUENTIAL);
+            feed->map = map;
+            feed->map_size = size;
+            feed->data = map;
+            feed->length = size / sizeof(double);
+            feed->eof = true;
+            warn_trailing_bytes(size % sizeof(double));
+            return feed;
+        }
+    }
+
+    feed->buffer = malloc(INPUT_BUFFER_SIZE);
+    if (feed->buffer == NULL) {
+        printf("[FATAL] failed to malloc input buffer\n");
+        free_input(feed);
+        return NULL;
+    }
+    feed->data = feed->buffer;
+    return feed;
+}
+
+bool refill_input(InputFeed *feed)
+{
+    if (feed->eof) {
+        return false;
+    }
+    // A read can end in the middle of a double, so move that partial double to the
+    // front of the buffer before reading more.
+    size_t consumed = feed->length * sizeof(double);
+    size_t leftover = feed->buffered_bytes - consumed;
+    memmove(feed->buffer, (char *)feed->buffer + consumed, leftover);
+    feed->buffered_bytes = leftover;
+    feed->length = feed->pos = 0;
+
+    // Always ask for as much as the buffer can hold so a fast producer gets drained in
+    // big chunks, but hand control back as soon as there's at least one double.
+    while (feed->buffered_bytes < sizeof(double)) {
+        ssize_t n = read(feed->fd, (char *)feed->buffer + feed->buffered_bytes,
+            INPUT_BUFFER_SIZE - feed->buffered_bytes);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == -1) {
+                printf("[FATAL] failed to read input: %s\n", strerror(errno));
+            }
+            feed->eof = true;
+            warn_trailing_bytes(feed->buffered_bytes);
+            return false;
+        }
+        feed->buffered_bytes += (size_t)n;
+    }
+    feed->length = feed->buffered_bytes / sizeof(double);
+    return true;
+}
+
+void free_input(InputFeed *feed)
+{
+    if (feed->map != NULL) {
+        munmap(feed->map, feed->map_size);
+    }
+    if (feed->fd != STDIN_FILENO) {
+        close(feed->fd);
+    }
+    free(feed->buffer);
+    free(feed);
+}
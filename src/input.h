@@ -0,0 +1,34 @@
+#ifndef ICHARD26_MASML_INPUT_H
+#define ICHARD26_MASML_INPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A stream of native-endian doubles. `data[pos..length)` is what's available right now,
+// read_input() only has to call into refill_input() once that window runs dry.
+typedef struct {
+    double const *data;
+    size_t length;
+    size_t pos;
+    int fd;
+    void *map;
+    size_t map_size;
+    double *buffer;
+    size_t buffered_bytes;
+    bool eof;
+} InputFeed;
+
+InputFeed *open_input(char const *path);
+bool refill_input(InputFeed *feed);
+void free_input(InputFeed *feed);
+
+static inline bool read_input(InputFeed *feed, double *value)
+{
+    if (feed->pos == feed->length && !refill_input(feed)) {
+        return false;
+    }
+    *value = feed->data[feed->pos++];
+    return true;
+}
+
+#endif
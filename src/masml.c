@@ -25,6 +25,11 @@
 // - https://stackoverflow.com/questions/42056160/static-functions-declared-in-c-header-files
 // - https://softwareengineering.stackexchange.com/questions/285811/c-module-where-to-put-prototypes-and-definitions-that-do-not-belong-to-the-pub
 
+#include "program.h"
+#include "optimize.h"
+#include "input.h"
+#include "shared.h"
+#include "profile.h"
 #include "util.h"
 #include "clikit.h"
 
@@ -35,29 +40,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define RAM_SIZE 1000
-
-typedef enum {
-    LOAD, STORE,
-    SET_REG, SWAP,
-    ADD, SUB, MUL, DIV, MOD,
-    EQUAL, NOT,
-    GOTO, GOTO_IF, GOTO_IF_NOT, EXIT,
-    PRINT
-} InstructionType;
-
-typedef enum { REG_NONE, REG_A, REG_B } RegisterID;
-
-typedef struct {
-    InstructionType type;
-    RegisterID reg;
-    double *arg;
-} Instruction;
-
-typedef struct {
-    Instruction *instrs;
-    size_t instr_count;
-} Program;
+#define CALL_STACK_SIZE 256
 
 // TODO: find a better way of creating string arrays for enum members.
 const char * const instruction_type_names[] = {
@@ -66,6 +49,10 @@ const char * const instruction_type_names[] = {
     [ADD] = "ADD", [SUB] = "SUBTRACT", [MUL] = "MULTIPLY", [DIV] = "DIVIDE", [MOD] = "MODULO",
     [EQUAL] = "EQUAL", [NOT] = "NOT",
     [GOTO] = "GOTO", [GOTO_IF] = "GOTO-IF", [GOTO_IF_NOT] = "GOTO-IF-NOT", [EXIT] = "EXIT",
+    [CALL] = "CALL", [RETURN] = "RETURN",
+    [READ] = "READ", [READ_OR_GOTO] = "READ-OR-GOTO",
+    [PUBLISH] = "PUBLISH", [ACQUIRE] = "ACQUIRE",
+    [MOVE] = "MOVE",
     [PRINT] = "PRINT",
     NULL
 };
@@ -85,6 +72,51 @@ void free_program(Program *program)
     free(program);
 }
 
+static bool parse_register(char const *s, RegisterID *id)
+{
+    char *end;
+    long n = (s[0] == '$' && s[1] != '\0' ? strtol(s + 1, &end, 10) : 0);
+    if (n < 1 || n > REGISTER_COUNT || *end != '\0') {
+        return false;
+    }
+    *id = (RegisterID)n;
+    return true;
+}
+
+// We need to give each unique variable their own RAM index as I'm not implementing a
+// hash table so string keys would work >.< `created` (if not NULL) is set to whether
+// `name` got allocated just now.
+static bool find_variable(char ***variables, size_t *variables_size, char *name,
+                          size_t *index, bool *created)
+{
+    bool found = find_string(*variables, name, index);
+    if (created != NULL) {
+        *created = !found;
+    }
+    if (found) {
+        return true;
+    }
+    // This variable hasn't been allocated an index yet, let's change that! By design,
+    // if find_string() doesn't find `name` in the array of strings (`variables`),
+    // `index` will be set to the next empty index, soooo allocating a new variable is
+    // quite simple, haha.
+    (*variables)[*index] = name;
+    if (*index + 1 >= *variables_size) {
+        assert(*index + 1 == *variables_size);
+        char **new_variables = realloc(*variables, sizeof(char *) * (*variables_size + 50));
+        if (new_variables == NULL) {
+            printf("[FATAL] failed to realloc `variables`\n");
+            return false;
+        }
+        // NOTE: the extra space realloc provides probably won't be NULLed so we have to
+        // do calloc's job ourselves >.<
+        memset(new_variables + *variables_size, 0, sizeof(char *) * 50);
+        *variables = new_variables;
+        *variables_size += 50;
+    }
+    return true;
+}
+
 Program *parse(char *ppbuf[], bool debug)
 {
     Program *prog = malloc(sizeof(*prog));
@@ -92,6 +124,7 @@ Program *parse(char *ppbuf[], bool debug)
     size_t instrs_size = 100;
     char **variables = calloc(sizeof(char *), variables_size);
     prog->instr_count = 0;
+    prog->shared_slots = 0;
     prog->instrs = calloc(sizeof(Instruction), instrs_size);
     size_t i = 1;
     // Since I want to print the line currently being parsed on error, a copy of `line`
@@ -137,6 +170,30 @@ Program *parse(char *ppbuf[], bool debug)
             arg = reg;
             reg = NULL;
         }
+        // SHARE isn't an instruction, it only moves a variable into the shared RAM
+        // segment so it mustn't take up an instruction index either.
+        if (strcmp(stype, "SHARE") == 0) {
+            size_t var_index;
+            bool created;
+            if (reg || arg == NULL || arg[0] != '&') {
+                printf("[FATAL] SHARE at line %zu only takes a variable\n", i);
+                goto BAIL;
+            }
+            if (!find_variable(&variables, &variables_size, arg, &var_index, &created)) {
+                goto BAIL;
+            }
+            if (!created || var_index != prog->shared_slots) {
+                printf("[FATAL] SHARE at line %zu must come before %s or any other "
+                    "unshared variable is used\n", i, arg);
+                goto BAIL;
+            }
+            prog->shared_slots++;
+            if (debug) {
+                printf("[LINE %-3zu]      %-13s %-7s %s -> ram[%zu]\n",
+                    i, stype, "", arg, var_index);
+            }
+            goto SKIP_LINE;
+        }
         // Time to verify this instruction makes sense, reject it otherwise.
         size_t instr_n;
         if (!find_string((char **)instruction_type_names, stype, &instr_n)) {
@@ -144,11 +201,13 @@ Program *parse(char *ppbuf[], bool debug)
             goto BAIL;
         }
         InstructionType type = (InstructionType)instr_n;
-        if (reg != NULL && reg[1] != '1' && reg[1] != '2') {
+        RegisterID reg_id = REG_NONE, src_reg_id = REG_NONE;
+        if (reg != NULL && !parse_register(reg, &reg_id)) {
             printf("[FATAL] unknown register at line %zu: %s\n", i, reg);
             goto BAIL;
         }
-        if (type == SWAP || type == GOTO || type == EXIT || type == PRINT) {
+        if (type == SWAP || type == GOTO || type == EXIT || type == PRINT
+                || type == CALL || type == RETURN) {
             if (reg && type != PRINT) {
                 printf("[FATAL] %s at line %zu doesn't need a register\n", stype, i);
                 goto BAIL;
@@ -157,7 +216,8 @@ Program *parse(char *ppbuf[], bool debug)
             printf("[FATAL] %s at line %zu requires a register\n", stype, i);
             goto BAIL;
         }
-        if (type == LOAD || type == STORE || type == PRINT) {
+        if (type == LOAD || type == STORE || type == PRINT || type == PUBLISH
+                || type == ACQUIRE) {
             if (arg && arg[0] != '&') {
                 printf("[FATAL] a constant is an unsupported argument for %s, line %zu\n",
                     stype, i);
@@ -170,34 +230,32 @@ Program *parse(char *ppbuf[], bool debug)
                 goto BAIL;
             }
         }
-        if ((arg && arg[0] != '&')
+        // The VM doesn't check for a missing argument, so reject it here instead.
+        if (arg == NULL && (type == GOTO || type == GOTO_IF || type == GOTO_IF_NOT
+                || type == CALL || type == READ_OR_GOTO || type == PUBLISH
+                || type == ACQUIRE)) {
+            printf("[FATAL] %s at line %zu requires an argument\n", stype, i);
+            goto BAIL;
+        }
+        if (arg != NULL && type == READ) {
+            printf("[FATAL] READ at line %zu doesn't take an argument\n", i);
+            goto BAIL;
+        }
+        if (type == MOVE) {
+            // MOVE is the only instruction whose argument is a (source) register.
+            if (arg == NULL || !parse_register(arg, &src_reg_id)) {
+                printf("[FATAL] MOVE at line %zu requires a source register\n", i);
+                goto BAIL;
+            }
+        } else if ((arg && arg[0] != '&')
                 && (atof(arg) == 0.0 && strcmp(arg, "0") && strcmp(arg, "0.0"))) {
             printf("[FATAL] invalid numerical constant on line %zu\n", i);
             goto BAIL;
         }
-        // We need to give each unique variable their own RAM index as I'm not
-        // implementing a hash table so string keys would work >.<
         size_t var_index = 20220723;
         if (arg && arg[0] == '&') {
-            if (!find_string(variables, arg, &var_index)) {
-                // This variable hasn't been allocated an index yet, let's change that!
-                // By design, if find_string() doesn't find `arg` in the array of
-                // strings (`variables`), `var_index` will be set to the next empty
-                // index, soooo allocating a new variable is quite simple, haha.
-                variables[var_index] = arg;
-                if (var_index + 1 >= variables_size) {
-                    assert(var_index + 1 == variables_size);
-                    char **new_variables = realloc(variables, sizeof(char *) * (variables_size + 50));
-                    if (new_variables == NULL) {
-                        printf("[FATAL] failed to realloc `variables`\n");
-                        goto BAIL;
-                    }
-                    // NOTE: the extra space realloc provides probably won't be NULLed so
-                    // we have to do calloc's job ourselves >.<
-                    memset(new_variables + 1, 0, sizeof(char *) * 50);
-                    variables = new_variables;
-                    variables_size += 50;
-                }
+            if (!find_variable(&variables, &variables_size, arg, &var_index, NULL)) {
+                goto BAIL;
             }
         }
         // We can *finally* prepare the final Instruction struct 🎉
@@ -210,17 +268,14 @@ Program *parse(char *ppbuf[], bool debug)
                     i, prog->instr_count, stype, reg, arg);
             }
         }
-        Instruction instr = { .type = type };
-        if (reg == NULL) {
-            instr.reg = REG_NONE;
-        } else {
-            instr.reg = (reg[1] == '1' ? REG_A : REG_B);
-        }
+        Instruction instr = { .type = type, .reg = reg_id };
         if (arg == NULL) {
             instr.arg = NULL;
         } else {
             instr.arg = malloc(sizeof(double));
-            if (arg[0] == '&') {
+            if (type == MOVE) {
+                *(instr.arg) = (double)src_reg_id;
+            } else if (arg[0] == '&') {
                 *(instr.arg) = (double)var_index;
             } else {
                 *(instr.arg) = atof(arg);
@@ -251,26 +306,45 @@ BAIL:
     return NULL;
 }
 
-double execute(Program program, bool debug)
+// Returns false if the program had to be stopped because of an error. Either way,
+// `result` is set to the value of $1 at the end.
+bool execute(Program program, double *ram, InputFeed *input, Profile *profile, bool debug,
+             double *result)
 {
-    double reg = 0, reg_b = 0;
+    // Slot 0 is never read, it only exists so REG_NONE can index `regs` just fine.
+    double regs[REGISTER_COUNT + 1] = {0};
     double *target_reg = NULL;
     double swap_temp;
-    double ram[RAM_SIZE] = {0};
-    for (size_t i = 0; i < program.instr_count; i++) {
+    // The return stack is preallocated and fixed-size so CALL never has to allocate.
+    // Each entry is the index of the CALL instruction, RETURN resumes right after it.
+    size_t call_stack[CALL_STACK_SIZE];
+    size_t call_depth = 0;
+    // Only log the registers the program actually uses (but at least $1 and $2).
+    size_t highest_reg = REG_B;
+    for (size_t i = 0; debug && i < program.instr_count; i++) {
+        Instruction instr = program.instrs[i];
+        size_t r = (instr.type == MOVE ? (size_t)*instr.arg : 0);
+        highest_reg = (instr.reg > highest_reg ? instr.reg : highest_reg);
+        highest_reg = (r > highest_reg ? r : highest_reg);
+    }
+    // NOTE: jumps set `next` instead of doing `i = target - 1` since that underflows
+    // when the target is the very first instruction.
+    for (size_t i = 0, next; i < program.instr_count; i = next) {
         Instruction instr = program.instrs[i];
+        next = i + 1;
+        if (profile) {
+            profile->counts[i]++;
+        }
         if (debug) {
             printf("[DEBUG] #%zu %s - register: %d - argument: %f\n",
                 i, instruction_type_names[instr.type], instr.reg, instr.arg ? *instr.arg: NAN);
-            printf("[DEBUG]   regA: %f, regB: %f\n", reg, reg_b);
-        }
-        if (instr.reg == REG_NONE) {
-            target_reg = NULL;
-        } else if (instr.reg == REG_A) {
-            target_reg = &reg;
-        } else if (instr.reg == REG_B) {
-            target_reg = &reg_b;
+            printf("[DEBUG]  ");
+            for (size_t r = 1; r <= highest_reg; r++) {
+                printf(" $%zu: %f", r, regs[r]);
+            }
+            printf("\n");
         }
+        target_reg = &regs[instr.reg];
         double *arg = instr.arg;
         switch (instr.type) {
             case LOAD:
@@ -279,53 +353,90 @@ double execute(Program program, bool debug)
             case STORE:
                 ram[(size_t)*arg] = *target_reg;
                 break;
+            case MOVE:
+                *target_reg = regs[(size_t)*arg];
+                break;
             case SET_REG:
                 *target_reg = *arg;
                 break;
             case SWAP:
-                swap_temp = reg;
-                reg = reg_b;
-                reg_b = swap_temp;
+                swap_temp = regs[REG_A];
+                regs[REG_A] = regs[REG_B];
+                regs[REG_B] = swap_temp;
                 break;
             case ADD:
-                *target_reg = (arg == NULL ? reg + reg_b : *target_reg + *arg);
+                *target_reg = (arg == NULL ? regs[REG_A] + regs[REG_B] : *target_reg + *arg);
                 break;
             case SUB:
-                *target_reg = (arg == NULL ? reg - reg_b : *target_reg - *arg);
+                *target_reg = (arg == NULL ? regs[REG_A] - regs[REG_B] : *target_reg - *arg);
                 break;
             case MUL:
-                *target_reg = (arg == NULL ? reg * reg_b : *target_reg * *arg);
+                *target_reg = (arg == NULL ? regs[REG_A] * regs[REG_B] : *target_reg * *arg);
                 break;
             case DIV:
-                *target_reg = (arg == NULL ? reg / reg_b : *target_reg / *arg);
+                *target_reg = (arg == NULL ? regs[REG_A] / regs[REG_B] : *target_reg / *arg);
                 break;
             case MOD:
-                *target_reg = (arg == NULL ? fmod(reg, reg_b) : fmod(*target_reg, *arg));
+                *target_reg = (arg == NULL ? fmod(regs[REG_A], regs[REG_B]) : fmod(*target_reg, *arg));
                 break;
             case EQUAL:
-                *target_reg = (arg == NULL ? reg == reg_b : *target_reg == *arg);
+                *target_reg = (arg == NULL ? regs[REG_A] == regs[REG_B] : *target_reg == *arg);
                 break;
             case NOT:
                 *target_reg = (*target_reg == 0.0);
                 break;
             case GOTO:
-                i = ((size_t)*arg) - 1;
-                assert(i <= program.instr_count);
+                next = (size_t)*arg;
+                assert(next <= program.instr_count);
                 break;
             case GOTO_IF:
                 if (*target_reg != 0.0) {
-                    i = ((size_t)*arg) -1;
-                    assert(i <= program.instr_count);
+                    next = (size_t)*arg;
+                    assert(next <= program.instr_count);
                 }
                 break;
             case GOTO_IF_NOT:
                 if (*target_reg == 0.0) {
-                    i = ((size_t)*arg) - 1;
-                    assert(i <= program.instr_count);
+                    next = (size_t)*arg;
+                    assert(next <= program.instr_count);
                 }
                 break;
             case EXIT:
-                return reg;
+                goto DONE;
+            case CALL:
+                if (call_depth == CALL_STACK_SIZE) {
+                    printf("[FATAL] call stack overflow at #%zu (max depth is %d)\n",
+                        i, CALL_STACK_SIZE);
+                    goto FAIL;
+                }
+                call_stack[call_depth++] = i;
+                next = (size_t)*arg;
+                assert(next <= program.instr_count);
+                break;
+            case RETURN:
+                if (call_depth == 0) {
+                    printf("[FATAL] RETURN at #%zu has no matching CALL\n", i);
+                    goto FAIL;
+                }
+                next = call_stack[--call_depth] + 1;
+                break;
+            case READ:
+                if (input == NULL || !read_input(input, target_reg)) {
+                    goto DONE;
+                }
+                break;
+            case READ_OR_GOTO:
+                if (input == NULL || !read_input(input, target_reg)) {
+                    next = (size_t)*arg;
+                    assert(next <= program.instr_count);
+                }
+                break;
+            case PUBLISH:
+                publish_slot(&ram[(size_t)*arg], *target_reg);
+                break;
+            case ACQUIRE:
+                *target_reg = acquire_slot(&ram[(size_t)*arg]);
+                break;
             case PRINT:
                 if (arg == NULL) {
                     printf("[OUTPUT] %f\n", *target_reg);
@@ -336,10 +447,21 @@ double execute(Program program, bool debug)
             default:
                 printf("[FATAL] unimplemented instruction: %s\n",
                     instruction_type_names[instr.type]);
-                break;
+                goto FAIL;
+        }
+        // Any instruction that didn't continue onto the next one must've jumped.
+        if (profile && next != i + 1) {
+            profile->taken[i]++;
         }
     }
-    return reg;
+
+DONE:
+    *result = regs[REG_A];
+    return true;
+
+FAIL:
+    *result = regs[REG_A];
+    return false;
 }
 
 int main(int argc, char *argv[])
@@ -351,6 +473,13 @@ int main(int argc, char *argv[])
         { .id = "result", .name = "show-result", .is_flag = true },
         { .id = "debug-parser", .is_flag = true },
         { .id = "debug-vm", .is_flag = true },
+        { .id = "debug-optimizer", .is_flag = true },
+        { .id = "no-optimize", .is_flag = true },
+        { .id = "input" },
+        { .id = "shm" },
+        { .id = "profile-generate" },
+        { .id = "profile-use" },
+        { .id = "stats", .name = "show-stats", .is_flag = true },
     };
     CLI *cli = SETUP_CLI(argv, "Richard's silly ASM-like language.", cli_args, cli_opts);
     PARSE_CLI_AND_MAYBE_RETURN(cli, argv);
@@ -358,7 +487,18 @@ int main(int argc, char *argv[])
     bool show_result = cli_get_bool(cli, "result");
     bool debug_parser = cli_get_bool(cli, "debug-parser");
     bool debug_vm = cli_get_bool(cli, "debug-vm");
+    bool debug_optimizer = cli_get_bool(cli, "debug-optimizer");
+    bool optimize = !cli_get_bool(cli, "no-optimize");
+    char const *input_path = cli_get_string(cli, "input");
+    char const *shm_name = cli_get_string(cli, "shm");
+    char const *profile_generate = cli_get_string(cli, "profile-generate");
+    char const *profile_use = cli_get_string(cli, "profile-use");
+    bool show_stats = cli_get_bool(cli, "stats");
     free_cli(cli);
+    if (profile_generate && profile_use) {
+        printf("[FATAL] --profile-generate and --profile-use can't be used together\n");
+        return 2;
+    }
 
     char **ppbuf = read_file(filepath);
     if (ppbuf == NULL) {
@@ -371,12 +511,66 @@ int main(int argc, char *argv[])
     if (prog == NULL) {
         return 1;
     }
+    if (optimize && (!inline_subroutines(prog, debug_optimizer)
+            || !promote_variables(prog, debug_optimizer))) {
+        free_program(prog);
+        return 1;
+    }
+    // Layout has to come last. Profiles are recorded against the program as it stands
+    // after every other optimization, that's the only way their indexes line up.
+    if (profile_use) {
+        Profile *profile = read_profile(prog, profile_use);
+        bool ok = (profile != NULL && layout_blocks(prog, profile, debug_optimizer));
+        if (profile != NULL) {
+            free_profile(profile);
+        }
+        if (!ok) {
+            free_program(prog);
+            return 1;
+        }
+    }
+    // NOTE: the profile must be created before map_ram() moves variables around as
+    // that'd change the program's checksum.
+    Profile *profile = NULL;
+    if ((profile_generate || show_stats) && (profile = new_profile(prog)) == NULL) {
+        free_program(prog);
+        return 1;
+    }
 
-    double result = execute(*prog, debug_vm);
-    if (show_result) {
+    int status = 1;
+    InputFeed *input = NULL;
+    // NOTE: map_ram() can move variables around so it has to run after optimization.
+    size_t ram_size;
+    double *ram = map_ram(prog, shm_name, &ram_size);
+    if (ram == NULL) {
+        goto CLEANUP;
+    }
+    if (input_path != NULL && (input = open_input(input_path)) == NULL) {
+        goto CLEANUP;
+    }
+
+    double result;
+    status = (execute(*prog, ram, input, profile, debug_vm, &result) ? 0 : 1);
+    if (show_result && status == 0) {
         printf("[RESULT] %f\n", result);
     }
+    if (show_stats) {
+        print_profile_stats(profile);
+    }
+    if (profile_generate && !write_profile(profile, profile_generate)) {
+        status = 1;
+    }
 
+CLEANUP:
+    if (input != NULL) {
+        free_input(input);
+    }
+    if (ram != NULL) {
+        unmap_ram(ram, ram_size);
+    }
+    if (profile != NULL) {
+        free_profile(profile);
+    }
     free_program(prog);
-    return 0;
+    return status;
 }
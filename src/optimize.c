@@ -0,0 +1,508 @@
+#include "optimize.h"
+#include "profile.h"
+#include "program.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Subroutines longer than this (not counting the RETURN) are left alone. Inlining big
+// subroutines would just bring back the code bloat CALL was meant to get rid of.
+#define INLINE_MAX_LENGTH 8
+#define NOT_INLINED SIZE_MAX
+
+static bool is_jump(InstructionType type)
+{
+    return type == GOTO || type == GOTO_IF || type == GOTO_IF_NOT || type == CALL
+        || type == READ_OR_GOTO;
+}
+
+static double *copy_arg(double const *arg)
+{
+    if (arg == NULL) {
+        return NULL;
+    }
+    double *copy = malloc(sizeof(double));
+    if (copy != NULL) {
+        *copy = *arg;
+    }
+    return copy;
+}
+
+// A subroutine is only inlined if it's a straight line of instructions ending with a
+// RETURN. No jumps, calls or exits means it can't be recursive and that the copied body
+// needs no jump target fixups, nice and simple.
+static bool find_inlinable_body(Program const *prog, size_t start, size_t *length)
+{
+    for (size_t i = start; i < prog->instr_count && i - start <= INLINE_MAX_LENGTH; i++) {
+        InstructionType type = prog->instrs[i].type;
+        if (type == RETURN) {
+            *length = i - start;
+            return true;
+        }
+        if (is_jump(type) || type == EXIT) {
+            return false;
+        }
+    }
+    return false;
+}
+
+bool inline_subroutines(Program *prog, bool debug)
+{
+    size_t count = prog->instr_count;
+    // `inlined_length[i]` is the length of the body copied over CALL #i (or NOT_INLINED)
+    // while `new_index[i]` is where old instruction #i ends up. The extra slot in
+    // `new_index` is for jumps that point just past the end of the program.
+    size_t *inlined_length = malloc(sizeof(size_t) * (count + 1));
+    size_t *new_index = malloc(sizeof(size_t) * (count + 1));
+    Instruction *instrs = NULL;
+    if (inlined_length == NULL || new_index == NULL) {
+        printf("[FATAL] failed to malloc inliner bookkeeping\n");
+        goto BAIL;
+    }
+
+    size_t new_count = 0, inlined = 0;
+    for (size_t i = 0; i < count; i++) {
+        Instruction instr = prog->instrs[i];
+        size_t length;
+        new_index[i] = new_count;
+        inlined_length[i] = NOT_INLINED;
+        if (instr.type == CALL && instr.arg && *instr.arg >= 0 && *instr.arg < (double)count
+                && find_inlinable_body(prog, (size_t)*instr.arg, &length)) {
+            if (debug) {
+                printf("[INLINE] #%-3zu CALL %zu -> %zu instruction(s)\n",
+                    i, (size_t)*instr.arg, length);
+            }
+            inlined_length[i] = length;
+            new_count += length;
+            inlined++;
+        } else {
+            new_count++;
+        }
+    }
+    new_index[count] = new_count;
+    if (inlined == 0) {
+        free(inlined_length);
+        free(new_index);
+        return true;
+    }
+
+    instrs = calloc(sizeof(Instruction), new_count + 1);
+    if (instrs == NULL) {
+        printf("[FATAL] failed to malloc inlined program\n");
+        goto BAIL;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (inlined_length[i] == NOT_INLINED) {
+            instrs[n++] = prog->instrs[i];
+            continue;
+        }
+        size_t start = (size_t)*prog->instrs[i].arg;
+        for (size_t j = start; j < start + inlined_length[i]; j++) {
+            instrs[n] = prog->instrs[j];
+            instrs[n].arg = copy_arg(prog->instrs[j].arg);
+            if (prog->instrs[j].arg && instrs[n].arg == NULL) {
+                printf("[FATAL] failed to malloc inlined argument\n");
+                goto BAIL;
+            }
+            n++;
+        }
+    }
+    // Inlined bodies never contain jumps so every jump left is an original one whose
+    // target needs to be moved to wherever that instruction lives now.
+    for (size_t i = 0; i < new_count; i++) {
+        double *arg = instrs[i].arg;
+        if (is_jump(instrs[i].type) && arg && *arg >= 0 && *arg <= (double)count) {
+            *arg = (double)new_index[(size_t)*arg];
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (inlined_length[i] != NOT_INLINED) {
+            free(prog->instrs[i].arg);
+        }
+    }
+    free(prog->instrs);
+    prog->instrs = instrs;
+    prog->instr_count = new_count;
+    if (debug) {
+        printf("[INLINE] inlined %zu call(s), program is now %zu instructions\n",
+            inlined, new_count);
+    }
+    free(inlined_length);
+    free(new_index);
+    return true;
+
+BAIL:
+    if (instrs != NULL) {
+        // Only the copied arguments belong to `instrs`, the rest are still owned by
+        // `prog` and will be freed along with it.
+        for (size_t i = 0, m = 0; i < count && m < new_count; i++) {
+            if (inlined_length[i] == NOT_INLINED) {
+                m++;
+                continue;
+            }
+            for (size_t j = 0; j < inlined_length[i] && m < new_count; j++, m++) {
+                free(instrs[m].arg);
+            }
+        }
+    }
+    free(instrs);
+    free(inlined_length);
+    free(new_index);
+    return false;
+}
+
+#define NO_BLOCK SIZE_MAX
+
+typedef enum { APPEND_NOTHING, APPEND_GOTO, APPEND_EXIT } BlockAppend;
+
+typedef struct {
+    size_t start, end;
+    unsigned long long count;
+    // Where control goes after the block, NO_BLOCK if it can't fall through (or jump).
+    size_t fallthrough, target;
+    unsigned long long fallthrough_weight, target_weight;
+    // How the block's last instruction gets fixed up once the new order is known.
+    bool drop_last, invert_last;
+    BlockAppend append;
+    size_t append_target;
+    size_t new_start;
+} Block;
+
+static bool ends_block(InstructionType type)
+{
+    return type == GOTO || type == GOTO_IF || type == GOTO_IF_NOT || type == READ_OR_GOTO
+        || type == EXIT || type == RETURN;
+}
+
+static bool is_conditional_jump(InstructionType type)
+{
+    return type == GOTO_IF || type == GOTO_IF_NOT || type == READ_OR_GOTO;
+}
+
+// Splits the program into basic blocks. Returns the number of blocks or zero if the
+// program has jumps that can't be laid out (eg. a jump past the end of the program).
+// `leader` is scratch space that must be zeroed and hold `instr_count + 1` bools.
+static size_t find_blocks(Program const *prog, Profile const *profile, Block *blocks,
+                          size_t *block_of, bool *leader)
+{
+    size_t count = prog->instr_count;
+    leader[0] = true;
+    for (size_t i = 0; i < count; i++) {
+        Instruction instr = prog->instrs[i];
+        if (is_jump(instr.type)) {
+            if (instr.arg == NULL || *instr.arg < 0 || *instr.arg >= (double)count) {
+                return 0;
+            }
+            leader[(size_t)*instr.arg] = true;
+        }
+        if (ends_block(instr.type)) {
+            leader[i + 1] = true;
+        }
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (leader[i]) {
+            blocks[n++] = (Block){ .start = i, .count = profile->counts[i] };
+        }
+        blocks[n - 1].end = i + 1;
+        block_of[i] = n - 1;
+    }
+
+    for (size_t b = 0; b < n; b++) {
+        size_t last = blocks[b].end - 1;
+        Instruction instr = prog->instrs[last];
+        blocks[b].fallthrough = blocks[b].target = NO_BLOCK;
+        if (instr.type == GOTO) {
+            blocks[b].target = block_of[(size_t)*instr.arg];
+            blocks[b].target_weight = profile->taken[last];
+        } else if (is_conditional_jump(instr.type)) {
+            blocks[b].target = block_of[(size_t)*instr.arg];
+            blocks[b].target_weight = profile->taken[last];
+            blocks[b].fallthrough = (b + 1 < n ? b + 1 : NO_BLOCK);
+            blocks[b].fallthrough_weight = profile->counts[last] - profile->taken[last];
+        } else if (instr.type != EXIT && instr.type != RETURN) {
+            blocks[b].fallthrough = (b + 1 < n ? b + 1 : NO_BLOCK);
+            blocks[b].fallthrough_weight = profile->counts[last];
+        }
+    }
+    return n;
+}
+
+// Greedily chains blocks together: after placing a block, its hottest successor that
+// hasn't been placed yet goes right after it (so it can be reached by falling through).
+// When a chain runs out, the hottest block left starts the next one. The entry block
+// always stays first.
+static void order_blocks(Block const *blocks, size_t n, bool *placed, size_t *order)
+{
+    size_t current = 0;
+    for (size_t k = 0; k < n; k++) {
+        if (current == NO_BLOCK) {
+            for (size_t b = 0; b < n; b++) {
+                if (!placed[b] && (current == NO_BLOCK || blocks[b].count > blocks[current].count)) {
+                    current = b;
+                }
+            }
+        }
+        order[k] = current;
+        placed[current] = true;
+
+        Block block = blocks[current];
+        bool fallthrough_free = block.fallthrough != NO_BLOCK && !placed[block.fallthrough];
+        bool target_free = block.target != NO_BLOCK && !placed[block.target];
+        if (target_free && (!fallthrough_free || block.target_weight > block.fallthrough_weight)) {
+            current = block.target;
+        } else if (fallthrough_free) {
+            current = block.fallthrough;
+        } else {
+            current = NO_BLOCK;
+        }
+    }
+}
+
+bool layout_blocks(Program *prog, Profile const *profile, bool debug)
+{
+    size_t count = prog->instr_count;
+    Block *blocks = malloc(sizeof(Block) * (count + 1));
+    size_t *block_of = malloc(sizeof(size_t) * (count + 1));
+    size_t *order = malloc(sizeof(size_t) * (count + 1));
+    bool *placed = calloc(sizeof(bool), count + 1);
+    double **new_args = NULL;
+    Instruction *instrs = NULL;
+    size_t n = 0, new_count = 0, new_gotos = 0, inverted = 0;
+    if (blocks == NULL || block_of == NULL || order == NULL || placed == NULL) {
+        printf("[FATAL] failed to malloc layout bookkeeping\n");
+        goto BAIL;
+    }
+    if (count == 0) {
+        goto DONE;
+    }
+    if ((n = find_blocks(prog, profile, blocks, block_of, placed)) == 0) {
+        if (debug) {
+            printf("[LAYOUT] program has unsupported jumps, leaving it alone\n");
+        }
+        goto DONE;
+    }
+    memset(placed, 0, sizeof(bool) * (count + 1));
+    order_blocks(blocks, n, placed, order);
+
+    // Figure out how each block needs to end now that its neighbours have changed. At
+    // most one instruction gets added per block, so everything can be allocated upfront
+    // and the actual rewrite below can't fail halfway through.
+    for (size_t k = 0; k < n; k++) {
+        Block *block = &blocks[order[k]];
+        size_t next = (k + 1 < n ? order[k + 1] : NO_BLOCK);
+        InstructionType type = prog->instrs[block->end - 1].type;
+        if (type == GOTO && block->target == next) {
+            block->drop_last = true;
+        } else if ((type == GOTO_IF || type == GOTO_IF_NOT) && block->target == next
+                && block->fallthrough != NO_BLOCK) {
+            block->invert_last = true;
+            inverted++;
+        } else if (block->fallthrough != next && type != GOTO && type != EXIT
+                && type != RETURN) {
+            block->append = (block->fallthrough == NO_BLOCK ? APPEND_EXIT : APPEND_GOTO);
+            new_gotos += (block->append == APPEND_GOTO);
+            // No point in jumping to a block that just jumps somewhere else again.
+            block->append_target = block->fallthrough;
+            if (block->append == APPEND_GOTO) {
+                Block const *dest = &blocks[block->fallthrough];
+                if (dest->end - dest->start == 1 && prog->instrs[dest->start].type == GOTO) {
+                    block->append_target = dest->target;
+                }
+            }
+        }
+        block->new_start = new_count;
+        new_count += block->end - block->start - block->drop_last
+            + (block->append != APPEND_NOTHING);
+    }
+    instrs = calloc(sizeof(Instruction), new_count + 1);
+    new_args = calloc(sizeof(double *), new_gotos + 1);
+    if (instrs == NULL || new_args == NULL) {
+        printf("[FATAL] failed to malloc laid out program\n");
+        goto BAIL;
+    }
+    for (size_t g = 0; g < new_gotos; g++) {
+        if ((new_args[g] = malloc(sizeof(double))) == NULL) {
+            printf("[FATAL] failed to malloc laid out program\n");
+            goto BAIL;
+        }
+    }
+
+    size_t m = 0, g = 0;
+    for (size_t k = 0; k < n; k++) {
+        Block block = blocks[order[k]];
+        for (size_t j = block.start; j < block.end; j++) {
+            Instruction instr = prog->instrs[j];
+            bool last = (j == block.end - 1);
+            if (last && block.drop_last) {
+                free(instr.arg);
+                continue;
+            }
+            if (last && block.invert_last) {
+                instr.type = (instr.type == GOTO_IF ? GOTO_IF_NOT : GOTO_IF);
+                *instr.arg = (double)blocks[block.fallthrough].new_start;
+            } else if (is_jump(instr.type)) {
+                *instr.arg = (double)blocks[block_of[(size_t)*instr.arg]].new_start;
+            }
+            instrs[m++] = instr;
+        }
+        if (block.append == APPEND_GOTO) {
+            *new_args[g] = (double)blocks[block.append_target].new_start;
+            instrs[m++] = (Instruction){ .type = GOTO, .reg = REG_NONE, .arg = new_args[g++] };
+        } else if (block.append == APPEND_EXIT) {
+            instrs[m++] = (Instruction){ .type = EXIT, .reg = REG_NONE, .arg = NULL };
+        }
+    }
+    assert(m == new_count && g == new_gotos);
+
+    if (debug) {
+        printf("[LAYOUT] block order:");
+        for (size_t k = 0; k < n; k++) {
+            printf(" #%zu", blocks[order[k]].start);
+        }
+        printf("\n[LAYOUT] %zu blocks, %zu -> %zu instructions, %zu branch(es) inverted\n",
+            n, count, new_count, inverted);
+    }
+    free(prog->instrs);
+    prog->instrs = instrs;
+    prog->instr_count = new_count;
+
+DONE:
+    free(new_args);
+    free(blocks);
+    free(block_of);
+    free(order);
+    free(placed);
+    return true;
+
+BAIL:
+    if (new_args != NULL) {
+        for (size_t g = 0; g < new_gotos; g++) {
+            free(new_args[g]);
+        }
+    }
+    free(new_args);
+    free(instrs);
+    free(blocks);
+    free(block_of);
+    free(order);
+    free(placed);
+    return false;
+}
+
+static bool uses_variable(InstructionType type)
+{
+    return type == LOAD || type == STORE || type == PRINT || type == PUBLISH
+        || type == ACQUIRE;
+}
+
+// Moves the private variables that are used the most inside loops into registers the
+// program doesn't touch, turning LOADs and STOREs into register to register MOVEs. Since
+// private RAM isn't visible once the program stops, nothing needs to be written back at
+// EXIT, and PRINT can simply print the register instead. Shared variables (and anything
+// used with PUBLISH or ACQUIRE) are left alone as other processes need to see them.
+bool promote_variables(Program *prog, bool debug)
+{
+    size_t count = prog->instr_count;
+    // `depth[i]` is how many loops instruction #i is part of. A loop is anything between
+    // a jump and an earlier (or the same) instruction it jumps back to.
+    size_t *depth = calloc(sizeof(size_t), count + 1);
+    unsigned long long *score = calloc(sizeof(unsigned long long), RAM_SIZE);
+    bool *excluded = calloc(sizeof(bool), RAM_SIZE);
+    bool used[REGISTER_COUNT + 1] = {0};
+    RegisterID promoted_to[RAM_SIZE] = {0};
+    if (depth == NULL || score == NULL || excluded == NULL) {
+        printf("[FATAL] failed to malloc promotion bookkeeping\n");
+        free(depth);
+        free(score);
+        free(excluded);
+        return false;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        Instruction instr = prog->instrs[i];
+        used[instr.reg] = true;
+        if (instr.type == MOVE) {
+            used[(size_t)*instr.arg] = true;
+        }
+        if (is_jump(instr.type) && instr.type != CALL && instr.arg
+                && *instr.arg >= 0 && *instr.arg <= (double)i) {
+            for (size_t j = (size_t)*instr.arg; j <= i; j++) {
+                depth[j]++;
+            }
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        Instruction instr = prog->instrs[i];
+        if (!uses_variable(instr.type) || instr.arg == NULL) {
+            continue;
+        }
+        size_t var = (size_t)*instr.arg;
+        if (var >= RAM_SIZE) {
+            continue;
+        }
+        // A loop nested in another one runs (way) more often, so weigh it accordingly.
+        score[var] += (depth[i] ? 1ULL << (depth[i] < 16 ? 4 * depth[i] : 60) : 0);
+        if (instr.type == PUBLISH || instr.type == ACQUIRE || var < prog->shared_slots) {
+            excluded[var] = true;
+        }
+    }
+
+    // $1 and $2 are never spare as SWAP, EXIT and the two register forms of
+    // instructions use them implicitly.
+    size_t promoted = 0;
+    for (size_t r = REG_B + 1; r <= REGISTER_COUNT; r++) {
+        if (used[r]) {
+            continue;
+        }
+        size_t best = RAM_SIZE;
+        for (size_t var = 0; var < RAM_SIZE; var++) {
+            if (score[var] && !excluded[var] && (best == RAM_SIZE || score[var] > score[best])) {
+                best = var;
+            }
+        }
+        if (best == RAM_SIZE) {
+            break;
+        }
+        promoted_to[best] = (RegisterID)r;
+        excluded[best] = true;
+        promoted++;
+        if (debug) {
+            printf("[PROMOTE] ram[%zu] -> $%zu (score %llu)\n", best, r, score[best]);
+        }
+    }
+
+    for (size_t i = 0; promoted && i < count; i++) {
+        Instruction *instr = &prog->instrs[i];
+        if (!uses_variable(instr->type) || instr->arg == NULL || *instr->arg >= RAM_SIZE) {
+            continue;
+        }
+        RegisterID r = promoted_to[(size_t)*instr->arg];
+        if (r == REG_NONE) {
+            continue;
+        }
+        if (instr->type == LOAD) {
+            instr->type = MOVE;
+            *instr->arg = (double)r;
+        } else if (instr->type == STORE) {
+            instr->type = MOVE;
+            *instr->arg = (double)instr->reg;
+            instr->reg = r;
+        } else if (instr->type == PRINT) {
+            instr->reg = r;
+            free(instr->arg);
+            instr->arg = NULL;
+        }
+    }
+    free(depth);
+    free(score);
+    free(excluded);
+    return true;
+}
@@ -0,0 +1,13 @@
+#ifndef ICHARD26_MASML_OPTIMIZE_H
+#define ICHARD26_MASML_OPTIMIZE_H
+
+#include "profile.h"
+#include "program.h"
+
+#include <stdbool.h>
+
+bool inline_subroutines(Program *prog, bool debug);
+bool promote_variables(Program *prog, bool debug);
+bool layout_blocks(Program *prog, Profile const *profile, bool debug);
+
+#endif
@@ -0,0 +1,143 @@
+// Referenced resources:
+// - https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function
+
+#include "profile.h"
+#include "program.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PROFILE_MAGIC "masml-profile 1"
+
+static unsigned long hash_bytes(unsigned long hash, void const *bytes, size_t n)
+{
+    unsigned char const *p = bytes;
+    for (size_t i = 0; i < n; i++) {
+        hash = (hash ^ p[i]) * 16777619UL;
+    }
+    return hash & 0xFFFFFFFFUL;
+}
+
+// FNV-1a over every instruction so a profile recorded for a different (or differently
+// optimized) program gets rejected instead of silently producing a nonsense layout.
+static unsigned long program_checksum(Program const *prog)
+{
+    unsigned long hash = 2166136261UL;
+    for (size_t i = 0; i < prog->instr_count; i++) {
+        Instruction instr = prog->instrs[i];
+        int fields[3] = { (int)instr.type, (int)instr.reg, instr.arg != NULL };
+        hash = hash_bytes(hash, fields, sizeof(fields));
+        if (instr.arg) {
+            hash = hash_bytes(hash, instr.arg, sizeof(double));
+        }
+    }
+    return hash;
+}
+
+Profile *new_profile(Program const *prog)
+{
+    Profile *profile = malloc(sizeof(*profile));
+    if (profile == NULL) {
+        printf("[FATAL] failed to malloc profile\n");
+        return NULL;
+    }
+    profile->instr_count = prog->instr_count;
+    profile->checksum = program_checksum(prog);
+    profile->counts = calloc(sizeof(unsigned long long), prog->instr_count + 1);
+    profile->taken = calloc(sizeof(unsigned long long), prog->instr_count + 1);
+    if (profile->counts == NULL || profile->taken == NULL) {
+        printf("[FATAL] failed to malloc profile counters\n");
+        free_profile(profile);
+        return NULL;
+    }
+    return profile;
+}
+
+Profile *read_profile(Program const *prog, char const *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        printf("[FATAL] can't open profile: %s\n", path);
+        return NULL;
+    }
+    Profile *profile = new_profile(prog);
+    if (profile == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+
+    char magic[sizeof(PROFILE_MAGIC)] = {0};
+    size_t instr_count;
+    unsigned long checksum;
+    if (fgets(magic, sizeof(magic), fp) == NULL || strcmp(magic, PROFILE_MAGIC)
+            || fscanf(fp, " instructions %zu checksum %lx", &instr_count, &checksum) != 2) {
+        printf("[FATAL] not a masml profile: %s\n", path);
+        goto BAIL;
+    }
+    if (instr_count != profile->instr_count || checksum != profile->checksum) {
+        printf("[FATAL] profile %s was recorded for a different program\n", path);
+        goto BAIL;
+    }
+    size_t i;
+    unsigned long long count, taken;
+    while (fscanf(fp, "%zu %llu %llu", &i, &count, &taken) == 3) {
+        if (i >= instr_count) {
+            printf("[FATAL] profile %s has an out of range instruction: #%zu\n", path, i);
+            goto BAIL;
+        }
+        profile->counts[i] = count;
+        profile->taken[i] = taken;
+    }
+    if (!feof(fp)) {
+        printf("[FATAL] malformed profile: %s\n", path);
+        goto BAIL;
+    }
+    fclose(fp);
+    return profile;
+
+BAIL:
+    free_profile(profile);
+    fclose(fp);
+    return NULL;
+}
+
+bool write_profile(Profile const *profile, char const *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        printf("[FATAL] can't open profile for writing: %s\n", path);
+        return false;
+    }
+    fprintf(fp, PROFILE_MAGIC "\ninstructions %zu checksum %lx\n",
+        profile->instr_count, profile->checksum);
+    for (size_t i = 0; i < profile->instr_count; i++) {
+        if (profile->counts[i]) {
+            fprintf(fp, "%zu %llu %llu\n", i, profile->counts[i], profile->taken[i]);
+        }
+    }
+    if (fclose(fp) != 0) {
+        printf("[FATAL] failed to write profile: %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+void print_profile_stats(Profile const *profile)
+{
+    unsigned long long executed = 0, taken = 0;
+    for (size_t i = 0; i < profile->instr_count; i++) {
+        executed += profile->counts[i];
+        taken += profile->taken[i];
+    }
+    printf("[STATS] %llu instructions executed, %llu jumps taken\n", executed, taken);
+}
+
+void free_profile(Profile *profile)
+{
+    free(profile->counts);
+    free(profile->taken);
+    free(profile);
+}
@@ -0,0 +1,25 @@
+#ifndef ICHARD26_MASML_PROFILE_H
+#define ICHARD26_MASML_PROFILE_H
+
+#include "program.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Per instruction execution counts. `taken[i]` is how many times instruction #i jumped
+// somewhere other than the next instruction. Profiles are tied to the exact program they
+// were recorded for, hence the checksum.
+typedef struct {
+    size_t instr_count;
+    unsigned long checksum;
+    unsigned long long *counts;
+    unsigned long long *taken;
+} Profile;
+
+Profile *new_profile(Program const *prog);
+Profile *read_profile(Program const *prog, char const *path);
+bool write_profile(Profile const *profile, char const *path);
+void print_profile_stats(Profile const *profile);
+void free_profile(Profile *profile);
+
+#endif
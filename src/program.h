@@ -0,0 +1,44 @@
+#ifndef ICHARD26_MASML_PROGRAM_H
+#define ICHARD26_MASML_PROGRAM_H
+
+#include <stddef.h>
+
+#define RAM_SIZE 1000
+#define REGISTER_COUNT 16
+
+typedef enum {
+    LOAD, STORE,
+    SET_REG, SWAP,
+    ADD, SUB, MUL, DIV, MOD,
+    EQUAL, NOT,
+    GOTO, GOTO_IF, GOTO_IF_NOT, EXIT,
+    CALL, RETURN,
+    READ, READ_OR_GOTO,
+    PUBLISH, ACQUIRE,
+    MOVE,
+    PRINT
+} InstructionType;
+
+// $1 and $2 get names since the two register forms of instructions (eg. `ADD $1`)
+// always use them as their operands. $3 to $16 are simply 3 to REGISTER_COUNT.
+typedef enum { REG_NONE, REG_A, REG_B } RegisterID;
+
+typedef struct {
+    InstructionType type;
+    RegisterID reg;
+    double *arg;
+} Instruction;
+
+typedef struct {
+    Instruction *instrs;
+    size_t instr_count;
+    // Variables declared with SHARE always get the first RAM indexes, so this is also
+    // where the private variables start.
+    size_t shared_slots;
+} Program;
+
+extern const char * const instruction_type_names[];
+
+void free_program(Program *program);
+
+#endif
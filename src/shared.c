@@ -0,0 +1,96 @@
+// Referenced resources:
+// - https://man7.org/linux/man-pages/man7/shm_overview.7.html
+// - https://man7.org/linux/man-pages/man3/shm_open.3.html
+// - https://man7.org/linux/man-pages/man2/mmap.2.html (MAP_FIXED)
+
+#define _DEFAULT_SOURCE
+
+#include "shared.h"
+#include "program.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static size_t round_up(size_t n, size_t multiple)
+{
+    return (n + multiple - 1) / multiple * multiple;
+}
+
+// Shared memory can only be mapped a page at a time, so the shared variables get the
+// first page(s) of RAM to themselves. The private variables that the parser put right
+// after them need to be moved past those pages, otherwise they'd be shared too!
+static void relocate_private_variables(Program *prog, size_t offset)
+{
+    for (size_t i = 0; i < prog->instr_count; i++) {
+        Instruction instr = prog->instrs[i];
+        bool uses_variable = (instr.type == LOAD || instr.type == STORE
+            || instr.type == PRINT || instr.type == PUBLISH || instr.type == ACQUIRE);
+        if (uses_variable && instr.arg && *instr.arg >= (double)prog->shared_slots) {
+            *instr.arg += (double)offset;
+        }
+    }
+}
+
+double *map_ram(Program *prog, char const *shm_name, size_t *ram_size)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t shared_size = 0;
+    if (shm_name != NULL && prog->shared_slots > 0) {
+        shared_size = round_up(sizeof(double) * prog->shared_slots, page_size);
+    }
+    size_t offset = (shared_size ? shared_size / sizeof(double) - prog->shared_slots : 0);
+    *ram_size = round_up(sizeof(double) * (RAM_SIZE + offset), page_size);
+
+    // Reserve (zeroed) memory for all of RAM first and then map the shared segment over
+    // the start of it. Anonymous memory is always zeroed, just like `double ram[] = {0}`.
+    double *ram = mmap(NULL, *ram_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ram == MAP_FAILED) {
+        printf("[FATAL] failed to mmap RAM\n");
+        return NULL;
+    }
+    if (shared_size == 0) {
+        if (shm_name != NULL) {
+            printf("[WARNING] --shm was given but the program doesn't SHARE anything\n");
+        }
+        return ram;
+    }
+
+    int fd = shm_open(shm_name, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+        printf("[FATAL] can't open shared memory segment: %s\n", shm_name);
+        goto BAIL;
+    }
+    // Whoever gets here first creates the segment (which starts out zeroed). Later
+    // programs might SHARE fewer variables, so never shrink it.
+    struct stat st;
+    if (fstat(fd, &st) == -1
+            || ((size_t)st.st_size < shared_size && ftruncate(fd, (off_t)shared_size) == -1)) {
+        printf("[FATAL] can't resize shared memory segment: %s\n", shm_name);
+        close(fd);
+        goto BAIL;
+    }
+    void *shared = mmap(ram, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+        fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        printf("[FATAL] failed to mmap shared memory segment: %s\n", shm_name);
+        goto BAIL;
+    }
+    relocate_private_variables(prog, offset);
+    return ram;
+
+BAIL:
+    munmap(ram, *ram_size);
+    return NULL;
+}
+
+void unmap_ram(double *ram, size_t ram_size)
+{
+    munmap(ram, ram_size);
+}
@@ -0,0 +1,39 @@
+#ifndef ICHARD26_MASML_SHARED_H
+#define ICHARD26_MASML_SHARED_H
+
+#include "program.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+static_assert(sizeof(double) == sizeof(uint64_t) && ATOMIC_LLONG_LOCK_FREE == 2,
+    "PUBLISH/ACQUIRE need RAM slots to double as lock-free 64-bit atomics"
+);
+
+double *map_ram(Program *prog, char const *shm_name, size_t *ram_size);
+void unmap_ram(double *ram, size_t ram_size);
+
+// PUBLISH and ACQUIRE are the only atomic RAM accesses, they treat the slot's bits as an
+// `_Atomic uint64_t`. A PUBLISH and an ACQUIRE that reads its value pair up so everything
+// stored before the PUBLISH is visible after the ACQUIRE. Plain LOAD/STORE/PRINT aren't
+// atomic, so a flag must only ever be touched with PUBLISH/ACQUIRE.
+static inline void publish_slot(double *slot, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    atomic_store_explicit((_Atomic uint64_t *)(void *)slot, bits, memory_order_release);
+}
+
+static inline double acquire_slot(double *slot)
+{
+    uint64_t bits = atomic_load_explicit((_Atomic uint64_t *)(void *)slot,
+        memory_order_acquire);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+#endif
@@ -24,14 +24,17 @@ set iskeyword+=-
 
 syn keyword CommentTodo contained TODO FIXME XXX
 syn keyword CmdType LOAD STORE
-syn keyword CmdType SET-REGISTER SWAP
+syn keyword CmdType SET-REGISTER SWAP MOVE
 syn keyword CmdType ADD SUBTRACT MULTIPLY DIVIDE MODULO
 syn keyword CmdType EQUAL NOT
 syn keyword CmdType GOTO GOTO-IF GOTO-IF-NOT EXIT
+syn keyword CmdType CALL RETURN
+syn keyword CmdType READ READ-OR-GOTO
+syn keyword CmdType PUBLISH ACQUIRE SHARE
 syn keyword CmdType PRINT
 
 syn match   Comment      "^#.*" contains=CommentTodo
-syn match   Register     "\$1\|\$2"
+syn match   Register     "\$\d\+"
 syn match   Number       "[-+]\?\d\+"
 syn match   Number       "[-+]\?\d*\.\d*"
 syn match   Variable     "&\S\+"